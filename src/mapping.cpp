@@ -618,7 +618,7 @@ intern ivec2 index_to_texture_coords(u32 index, u32 row_width, u32 height)
     return {(int)(index % row_width), (int)height - (int)(index / row_width)};
 }
 
-intern void update_scene_map_from_occ_grid(occ_grid_map *map, const occ_grid_update &grid)
+intern void update_scene_map_from_occ_grid(occ_grid_map *map, const packet_view<occ_grid_update> &grid)
 {
     ivec2 resized{map->image->GetWidth(), map->image->GetHeight()};
     while (resized.x_ < grid.meta.width)
@@ -695,7 +695,7 @@ intern void update_scene_map_from_occ_grid(occ_grid_map *map, const occ_grid_upd
     map->rend_texture->SetData(map->image);
 }
 
-intern void update_scene_from_scan(map_panel *mp, const lidar_scan &packet)
+intern void update_scene_from_scan(map_panel *mp, const packet_view<lidar_scan> &packet)
 {
     // Resize the billboard count to match the received scan
     sizet range_count = lidar_get_range_count(packet.meta);
@@ -750,14 +750,14 @@ intern void update_node_transform(map_panel *mp, const node_transform &tform)
     node->SetRotationSilent(quat_from(tform.orientation));
 }
 
-intern void update_glob_nav_path(map_panel *mp, const nav_path &np)
+intern void update_glob_nav_path(map_panel *mp, const packet_view<nav_path> &np)
 {
     mp->glob_npview.entry_count = np.path_cnt;
     for (int i = 0; i < np.path_cnt; ++i)
         mp->glob_npview.path_entries[i] = vec3_from(np.path[i].pos);
 }
 
-intern void update_loc_nav_path(map_panel *mp, const nav_path &np)
+intern void update_loc_nav_path(map_panel *mp, const packet_view<nav_path> &np)
 {
     mp->loc_npview.entry_count = np.path_cnt;
     for (int i = 0; i < np.path_cnt; ++i)
@@ -1019,11 +1019,11 @@ intern void update_meta_stats(map_panel *mp, const misc_stats &updated_stats)
     }
 }
 
-intern void update_image(map_panel *mp, const compressed_image &img)
+intern void update_image(map_panel *mp, const packet_view<compressed_image> &img)
 {
     ivec2 sz{};
     int channels{0};
-    u8 *converted_data = stbi_load_from_memory(img.data, img.meta.data_size, &sz.x_, &sz.y_, &channels, 3);
+    u8 *converted_data = stbi_load_from_memory(img.data.data, img.meta.data_size, &sz.x_, &sz.y_, &channels, 3);
 
     auto cur_sz = ivec2{mp->cam_view.rend_text->GetWidth(), mp->cam_view.rend_text->GetHeight()};
     if (cur_sz != sz) {
@@ -1054,27 +1054,37 @@ void map_panel_init(map_panel *mp, const ui_info &ui_inf, net_connection *conn,
     setup_conn_text(mp, ui_inf);
     setup_path_length_text(mp, ui_inf);
 
-    ss_connect(&mp->router, conn->scan_received, [mp](const lidar_scan &pckt) { update_scene_from_scan(mp, pckt); });
+    ss_connect(&mp->router, conn->scan_received, [mp](const packet_view<lidar_scan> &pckt) {
+        update_scene_from_scan(mp, pckt);
+    });
 
-    ss_connect(&mp->router, conn->map_update_received, [mp](const occ_grid_update &pckt) {
+    ss_connect(&mp->router, conn->map_update_received, [mp](const packet_view<occ_grid_update> &pckt) {
         update_scene_map_from_occ_grid(&mp->map, pckt);
     });
 
-    ss_connect(&mp->router, conn->glob_cm_update_received, [mp](const occ_grid_update &pckt) {
+    ss_connect(&mp->router, conn->glob_cm_update_received, [mp](const packet_view<occ_grid_update> &pckt) {
         update_scene_map_from_occ_grid(&mp->glob_cmap, pckt);
     });
-    ss_connect(&mp->router, conn->loc_cm_update_received, [mp](const occ_grid_update &pckt) {
+    ss_connect(&mp->router, conn->loc_cm_update_received, [mp](const packet_view<occ_grid_update> &pckt) {
         update_scene_map_from_occ_grid(&mp->loc_cmap, pckt);
     });
     ss_connect(
         &mp->router, conn->transform_updated, [mp](const node_transform &pckt) { update_node_transform(mp, pckt); });
-    ss_connect(&mp->router, conn->glob_nav_path_updated, [mp](const nav_path &pckt) { update_glob_nav_path(mp, pckt); });
-    ss_connect(&mp->router, conn->loc_nav_path_updated, [mp](const nav_path &pckt) { update_loc_nav_path(mp, pckt); });
+    ss_connect(&mp->router, conn->glob_nav_path_updated, [mp](const packet_view<nav_path> &pckt) {
+        update_glob_nav_path(mp, pckt);
+    });
+    ss_connect(&mp->router, conn->loc_nav_path_updated, [mp](const packet_view<nav_path> &pckt) {
+        update_loc_nav_path(mp, pckt);
+    });
     ss_connect(&mp->router, conn->goal_status_updated, [mp](const current_goal_status &pckt) {
         update_cur_goal_status(mp, pckt);
     });
-    ss_connect(&mp->router, conn->image_update, [mp](const compressed_image &img) { update_image(mp, img); });
-    ss_connect(&mp->router, conn->image_update, [mp](const compressed_image &img) { update_image(mp, img); });
+    ss_connect(&mp->router, conn->image_update, [mp](const packet_view<compressed_image> &img) {
+        update_image(mp, img);
+    });
+    ss_connect(&mp->router, conn->image_update, [mp](const packet_view<compressed_image> &img) {
+        update_image(mp, img);
+    });
     ss_connect(&mp->router, conn->meta_stats_update, [mp](const misc_stats &ms) { update_meta_stats(mp, ms); });
 
     setup_input_actions(mp, ui_inf, conn, inp);
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -12,6 +13,11 @@
 #include "logging.h"
 #include <poll.h>
 
+#if !defined(__EMSCRIPTEN__)
+#include <mutex>
+#include <thread>
+#endif
+
 //#define PACKET_DEBUG
 
 #if defined(PACKET_DEBUG)
@@ -20,6 +26,27 @@
 #define packet_dlog(...)
 #endif
 
+// Grow the ring so it can hold required bytes, at least doubling to keep the number of regrows down. Returns false if
+// required is over the memory budget.
+intern bool rx_buffer_reserve(net_rx_buffer *rxb, sizet required)
+{
+    if (required <= rxb->ring.capacity)
+        return true;
+    if (required > rxb->memory_budget)
+        return false;
+
+    sizet capacity = std::min(std::max(required, rxb->ring.capacity * 2), rxb->memory_budget);
+    if (!ring_buffer_grow(&rxb->ring, capacity))
+        return false;
+
+    ilog("Grew rx buffer to %d bytes to fit %d byte packet (high water mark %d - budget %d)",
+         rxb->ring.capacity,
+         required,
+         rxb->high_water_mark,
+         rxb->memory_budget);
+    return true;
+}
+
 #if defined(__EMSCRIPTEN__)
 #include <emscripten/websocket.h>
 
@@ -110,15 +137,16 @@ intern EM_BOOL em_ws_on_error(int event_type, const EmscriptenWebSocketErrorEven
 intern EM_BOOL em_ws_on_message(int event_type, const EmscriptenWebSocketMessageEvent *ws_event, void *user_data)
 {
     auto conn = (net_connection *)user_data;
-    assert((net_rx_buffer::MAX_PACKET_SIZE - conn->rx_buf->read_buf.cur_offset - conn->rx_buf->available) >
-           ws_event->numBytes);
-
-    memcpy(conn->rx_buf->read_buf.data + conn->rx_buf->read_buf.cur_offset + conn->rx_buf->available,
-           ws_event->data,
-           ws_event->numBytes);
-    conn->rx_buf->available += ws_event->numBytes;
     if (ws_event->numBytes > 0) {
-        packet_dlog("Added %d bytes to available - result:%d", ws_event->numBytes, conn->rx_buf->available);
+        // Websocket messages can't be left for later like socket reads, so grow to fit the whole message
+        net_rx_buffer *rxb = &conn->rx_buf;
+        rx_buffer_reserve(rxb, ring_buffer_available(rxb->ring) + ws_event->numBytes);
+        sizet written = ring_buffer_write(&conn->rx_buf.ring, ws_event->data, ws_event->numBytes);
+        if (written < ws_event->numBytes)
+            elog("Receive buffer full - dropped %d of %d ws message bytes",
+                 ws_event->numBytes - written,
+                 ws_event->numBytes);
+        packet_dlog("Added %d bytes to available - result:%d", written, ring_buffer_available(conn->rx_buf.ring));
     }
     else {
         elog("Got ws message with %d bytes....", ws_event->numBytes);
@@ -198,45 +226,593 @@ intern void em_net_connect(net_connection *conn)
 
 intern void alloc_connection(net_connection *conn)
 {
-    conn->rx_buf = (net_rx_buffer *)malloc(sizeof(net_rx_buffer));
-    conn->pckts.scan = (lidar_scan *)malloc(sizeof(lidar_scan));
+    ring_buffer_init(&conn->rx_buf.ring, std::min(net_rx_buffer::INITIAL_CAPACITY, conn->rx_buf.memory_budget));
+    conn->rx_buf.cur_packet_size = 0;
+    conn->rx_buf.discard_size = 0;
+    conn->rx_buf.high_water_mark = 0;
     conn->pckts.ntf = (node_transform *)malloc(sizeof(node_transform));
-    conn->pckts.gu = (occ_grid_update *)malloc(sizeof(occ_grid_update));
-    conn->pckts.navp = (nav_path *)malloc(sizeof(nav_path));
     conn->pckts.cur_goal_stat = (current_goal_status *)malloc(sizeof(current_goal_status));
-    conn->pckts.txt = (text_block *)malloc(sizeof(text_block));
     conn->pckts.cmdp = (command_set_params *)malloc(sizeof(command_set_params));
-    conn->pckts.img = (compressed_image *)malloc(sizeof(compressed_image));
     conn->pckts.ms = (misc_stats *)malloc(sizeof(misc_stats));
 
-    memset(conn->rx_buf, 0, sizeof(net_rx_buffer));
-    memset(conn->pckts.scan, 0, sizeof(lidar_scan));
     memset(conn->pckts.ntf, 0, sizeof(node_transform));
-    memset(conn->pckts.gu, 0, sizeof(occ_grid_update));
-    memset(conn->pckts.navp, 0, sizeof(nav_path));
     memset(conn->pckts.cur_goal_stat, 0, sizeof(current_goal_status));
-    memset(conn->pckts.txt, 0, sizeof(text_block));
     memset(conn->pckts.cmdp, 0, sizeof(command_set_params));
-    memset(conn->pckts.img, 0, sizeof(compressed_image));
     memset(conn->pckts.ms, 0, sizeof(misc_stats));
 }
 
 intern void free_connection(net_connection *conn)
 {
-    free(conn->rx_buf);
-    free(conn->pckts.scan);
+    ilog("Rx buffer high water mark was %d bytes (capacity %d - budget %d)",
+         conn->rx_buf.high_water_mark,
+         conn->rx_buf.ring.capacity,
+         conn->rx_buf.memory_budget);
+    ring_buffer_term(&conn->rx_buf.ring);
     free(conn->pckts.ntf);
-    free(conn->pckts.gu);
-    free(conn->pckts.navp);
     free(conn->pckts.cur_goal_stat);
-    free(conn->pckts.txt);
     free(conn->pckts.cmdp);
-    free(conn->pckts.img);
     free(conn->pckts.ms);
 }
 
+using rx_archive = binary_buffer_archive;
+
+// Point span at the next count elements of the read buffer and skip over them
+template<class T>
+intern void take_span(rx_archive &read_buf, rx_span<T> *span, sizet count)
+{
+    span->data = read_buf.data + read_buf.cur_offset;
+    span->size = count;
+    read_buf.cur_offset += count * sizeof(T);
+}
+
+template<class MetaT>
+sizet header_and_meta_size()
+{
+    return packet_header::size + packed_sizeof<MetaT>();
+}
+
+// Decode just the meta of a variable length packet starting at data - there must be at least header_and_meta_size
+// bytes available
+template<class MetaT>
+intern MetaT peek_packet_meta(const u8 *data)
+{
+    rx_archive read_buf{(u8 *)data, PACK_DIR_IN};
+    packet_header header;
+    MetaT meta;
+    pack_unpack(read_buf, header, {"header"});
+    pack_unpack(read_buf, meta, {"meta"});
+    return meta;
+}
+
+// The packet size functions return the full size of a variable length packet from its meta
+intern sizet scan_packet_size(const u8 *data)
+{
+    auto meta = peek_packet_meta<lidar_scan_meta>(data);
+    return header_and_meta_size<lidar_scan_meta>() + lidar_get_range_count(meta) * sizeof(float);
+}
+
+intern sizet occ_grid_packet_size(const u8 *data)
+{
+    auto meta = peek_packet_meta<occ_grid_meta>(data);
+    return header_and_meta_size<occ_grid_meta>() + meta.change_elem_count * sizeof(u32);
+}
+
+intern sizet nav_path_packet_size(const u8 *data)
+{
+    auto path_cnt = peek_packet_meta<u32>(data);
+    return header_and_meta_size<u32>() + path_cnt * sizeof(pose);
+}
+
+intern sizet text_block_packet_size(const u8 *data)
+{
+    auto txt_size = peek_packet_meta<u32>(data);
+    return header_and_meta_size<u32>() + txt_size;
+}
+
+intern sizet comp_img_packet_size(const u8 *data)
+{
+    auto meta = peek_packet_meta<compressed_image_meta>(data);
+    return header_and_meta_size<compressed_image_meta>() + meta.data_size;
+}
+
+intern void handle_scan_packet(rx_archive &read_buf, net_connection *conn)
+{
+    packet_view<lidar_scan> scan;
+    pack_unpack(read_buf, scan.header, {"header"});
+    pack_unpack(read_buf, scan.meta, {"meta"});
+    take_span(read_buf, &scan.ranges, lidar_get_range_count(scan.meta));
+    conn->scan_received(0, scan);
+}
+
+intern void handle_occ_grid_pckt(rx_archive &read_buf, ss_signal<const packet_view<occ_grid_update> &> &sig)
+{
+    packet_view<occ_grid_update> gu;
+    pack_unpack(read_buf, gu.header, {"header"});
+    pack_unpack(read_buf, gu.meta, {"meta"});
+    take_span(read_buf, &gu.change_elems, gu.meta.change_elem_count);
+    sig(0, gu);
+}
+
+intern void handle_nav_path_packet(rx_archive &read_buf, ss_signal<const packet_view<nav_path> &> &sig)
+{
+    packet_view<nav_path> npckt;
+    pack_unpack(read_buf, npckt.header, {"header"});
+    pack_unpack(read_buf, npckt.path_cnt, {"path_cnt"});
+    take_span(read_buf, &npckt.path, npckt.path_cnt);
+    sig(0, npckt);
+}
+
+intern void handle_text_block_packet(rx_archive &read_buf, ss_signal<const packet_view<text_block> &> &sig)
+{
+    packet_view<text_block> txt_pckt;
+    pack_unpack(read_buf, txt_pckt.header, {"header"});
+    pack_unpack(read_buf, txt_pckt.txt_size, {"txt_size"});
+    take_span(read_buf, &txt_pckt.text, txt_pckt.txt_size);
+    sig(0, txt_pckt);
+}
+
+intern void handle_comp_img_packet(rx_archive &read_buf, ss_signal<const packet_view<compressed_image> &> &sig)
+{
+    packet_view<compressed_image> img;
+    pack_unpack(read_buf, img.header, {"header"});
+    pack_unpack(read_buf, img.meta, {"meta"});
+    take_span(read_buf, &img.data, img.meta.data_size);
+    sig(0, img);
+}
+
+intern void handle_goal_status_packet(rx_archive &read_buf, net_connection *conn)
+{
+    pack_unpack(read_buf, *conn->pckts.cur_goal_stat, {});
+    conn->goal_status_updated(0, *conn->pckts.cur_goal_stat);
+}
+
+intern void handle_tform_packet(rx_archive &read_buf, net_connection *conn)
+{
+    pack_unpack(read_buf, *conn->pckts.ntf, {});
+    conn->transform_updated(0, *conn->pckts.ntf);
+}
+
+intern void handle_misc_stats(rx_archive &read_buf, net_connection *conn)
+{
+    pack_unpack(read_buf, *conn->pckts.ms, {});
+    conn->meta_stats_update(0, *conn->pckts.ms);
+}
+
+intern bool matches_packet_id(const char *packet_id, const u8 *data)
+{
+    int result = strncmp((const char *)data, packet_id, packet_header::size);
+    return (result == 0);
+}
+
+// Handlers are only called once all of the packet's bytes are available, with read_buf at the start of the packet
+using packet_handler = void (*)(rx_archive &read_buf, net_connection *conn);
+
+struct packet_registry_entry
+{
+    u8 type;
+    const char *id;
+
+    // Bytes needed (including the packet header) before the packet size is known - for variable length packets this
+    // is just enough to read the meta data which holds the payload size
+    sizet (*fixed_size)();
+
+    // Full packet size from the header and meta - null for fixed size packets
+    sizet (*packet_size)(const u8 *data);
+    packet_handler handler;
+
+    // Only the most recent packet of this type matters - when packets are buffered up older ones can be dropped
+    bool latest_only;
+};
+
+// To add a packet type add it to packet_type and register it here - entries must be in packet_type order
+intern const packet_registry_entry packet_registry[PACKET_TYPE_COUNT] = {
+    {PACKET_TYPE_SCAN,
+     SCAN_PACKET_ID,
+     header_and_meta_size<lidar_scan_meta>,
+     scan_packet_size,
+     handle_scan_packet,
+     true},
+    {PACKET_TYPE_MAP,
+     MAP_PCKT_ID,
+     header_and_meta_size<occ_grid_meta>,
+     occ_grid_packet_size,
+     [](rx_archive &read_buf, net_connection *conn) { handle_occ_grid_pckt(read_buf, conn->map_update_received); },
+     false},
+    {PACKET_TYPE_GLOB_CM,
+     GLOB_CM_PCKT_ID,
+     header_and_meta_size<occ_grid_meta>,
+     occ_grid_packet_size,
+     [](rx_archive &read_buf, net_connection *conn) { handle_occ_grid_pckt(read_buf, conn->glob_cm_update_received); },
+     false},
+    {PACKET_TYPE_LOC_CM,
+     LOC_CM_PCKT_ID,
+     header_and_meta_size<occ_grid_meta>,
+     occ_grid_packet_size,
+     [](rx_archive &read_buf, net_connection *conn) { handle_occ_grid_pckt(read_buf, conn->loc_cm_update_received); },
+     false},
+    {PACKET_TYPE_TFORM, TFORM_PCKT_ID, packed_sizeof<node_transform>, nullptr, handle_tform_packet, true},
+    {PACKET_TYPE_GLOB_NAVP,
+     GLOB_NAVP_PCKT_ID,
+     header_and_meta_size<u32>,
+     nav_path_packet_size,
+     [](rx_archive &read_buf, net_connection *conn) { handle_nav_path_packet(read_buf, conn->glob_nav_path_updated); },
+     false},
+    {PACKET_TYPE_LOC_NAVP,
+     LOC_NAVP_PCKT_ID,
+     header_and_meta_size<u32>,
+     nav_path_packet_size,
+     [](rx_archive &read_buf, net_connection *conn) { handle_nav_path_packet(read_buf, conn->loc_nav_path_updated); },
+     false},
+    {PACKET_TYPE_GOAL_STAT,
+     GOAL_STAT_PCKT_ID,
+     packed_sizeof<current_goal_status>,
+     nullptr,
+     handle_goal_status_packet,
+     true},
+    {PACKET_TYPE_SET_PARAMS_RESP,
+     SET_PARAMS_RESP_CMD_PCKT_ID,
+     packed_sizeof<text_block>,
+     text_block_packet_size,
+     [](rx_archive &read_buf, net_connection *conn) {
+         handle_text_block_packet(read_buf, conn->param_set_response_received);
+     },
+     false},
+    {PACKET_TYPE_GET_PARAMS_RESP,
+     GET_PARAMS_RESP_CMD_PCKT_ID,
+     packed_sizeof<text_block>,
+     text_block_packet_size,
+     [](rx_archive &read_buf, net_connection *conn) {
+         handle_text_block_packet(read_buf, conn->param_get_response_received);
+     },
+     false},
+    {PACKET_TYPE_COMP_IMG,
+     COMP_IMG_PCKT_ID,
+     header_and_meta_size<compressed_image_meta>,
+     comp_img_packet_size,
+     [](rx_archive &read_buf, net_connection *conn) { handle_comp_img_packet(read_buf, conn->image_update); },
+     false},
+    {PACKET_TYPE_MISC_STATS, MISC_STATS_PCKT_ID, packed_sizeof<misc_stats>, nullptr, handle_misc_stats, true},
+};
+
+struct packet_lut_slot
+{
+    u32 hash;
+    u8 type{PACKET_TYPE_INVALID};
+};
+
+// Open addressed hash table from the hashed packet ID strings to packet types, built once on the first connect
+struct packet_lut
+{
+    static constexpr sizet SLOT_COUNT = 64;
+    packet_lut_slot slots[SLOT_COUNT];
+    sizet fixed_sizes[PACKET_TYPE_COUNT];
+    bool initialized{false};
+};
+
+intern packet_lut pckt_lut{};
+
+// FNV-1a over the header bytes up to the null terminator - same bytes strncmp would look at
+intern u32 hash_packet_id(const u8 *data)
+{
+    u32 hash = 2166136261u;
+    for (int i = 0; i < packet_header::size && data[i] != 0; ++i) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+intern void packet_registry_init()
+{
+    if (pckt_lut.initialized)
+        return;
+
+    static_assert((packet_lut::SLOT_COUNT & (packet_lut::SLOT_COUNT - 1)) == 0, "Slot count must be a power of two");
+    static_assert(packet_lut::SLOT_COUNT > PACKET_TYPE_COUNT, "Not enough slots for every packet type");
+    for (int i = 0; i < PACKET_TYPE_COUNT; ++i) {
+        assert(packet_registry[i].type == i && "Packet registry entries must be in packet_type order");
+        u32 hash = hash_packet_id((const u8 *)packet_registry[i].id);
+        sizet slot = hash & (packet_lut::SLOT_COUNT - 1);
+        while (pckt_lut.slots[slot].type != PACKET_TYPE_INVALID)
+            slot = (slot + 1) & (packet_lut::SLOT_COUNT - 1);
+        pckt_lut.slots[slot] = {hash, (u8)i};
+        pckt_lut.fixed_sizes[i] = packet_registry[i].fixed_size();
+    }
+    pckt_lut.initialized = true;
+}
+
+// Returns PACKET_TYPE_INVALID if data doesn't start with a registered packet ID
+intern u8 classify_packet(const u8 *data)
+{
+    u32 hash = hash_packet_id(data);
+    sizet slot = hash & (packet_lut::SLOT_COUNT - 1);
+    while (pckt_lut.slots[slot].type != PACKET_TYPE_INVALID) {
+        const packet_lut_slot &entry = pckt_lut.slots[slot];
+        if (entry.hash == hash && matches_packet_id(packet_registry[entry.type].id, data))
+            return entry.type;
+        slot = (slot + 1) & (packet_lut::SLOT_COUNT - 1);
+    }
+    return PACKET_TYPE_INVALID;
+}
+
+intern bool dispatch_packet(const u8 *packet, u8 type, sizet packet_size, net_connection *conn)
+{
+    rx_archive read_buf{(u8 *)packet, PACK_DIR_IN};
+    packet_registry[type].handler(read_buf, conn);
+    assert(read_buf.cur_offset == packet_size && "Handler did not read the whole packet");
+    return true;
+}
+
+// Skip over what is available of a packet that was too large for the memory budget
+intern void skip_discarded_bytes(rx_archive &read_buf, sizet *available, net_rx_buffer *rxb)
+{
+    sizet skip = std::min(*available, rxb->discard_size);
+    read_buf.cur_offset += skip;
+    *available -= skip;
+    rxb->discard_size -= skip;
+}
+
+// Called with each complete packet found by parse_rx_buffer - returning false leaves the packet in the buffer to be
+// tried again on the next parse
+using packet_sink = bool (*)(const u8 *packet, u8 type, sizet packet_size, net_connection *conn);
+
+intern void parse_rx_buffer(net_rx_buffer *rxb, packet_sink sink, net_connection *conn)
+{
+    // The ring's readable range is contiguous, so packets are decoded in place starting at the read pointer - bytes
+    // are only consumed (and handed back to the producer) once we are done parsing
+    sizet available = ring_buffer_available(rxb->ring);
+    rxb->high_water_mark = std::max(rxb->high_water_mark, available);
+    rx_archive read_buf{ring_buffer_read_ptr(rxb->ring), PACK_DIR_IN};
+    skip_discarded_bytes(read_buf, &available, rxb);
+
+    // While there are enough available bytes to read in a message header and we
+    // are not waiting for more data
+    bool need_more_data = false;
+    while (available >= packet_header::size && !need_more_data && rxb->discard_size == 0) {
+        // Current packet size of 0 indicates we are searching for a header
+        if (rxb->cur_packet_size == 0) {
+            u8 type = classify_packet(read_buf.data + read_buf.cur_offset);
+
+            // If no header match is found
+            if (type == PACKET_TYPE_INVALID) {
+                --available;
+                ++read_buf.cur_offset;
+            }
+            else {
+                rxb->cur_packet_type = type;
+                rxb->cur_packet_size = pckt_lut.fixed_sizes[type];
+                packet_dlog("Found packet header for packet size %d (available:%d  Readbuf offset:%d)",
+                            rxb->cur_packet_size,
+                            available,
+                            read_buf.cur_offset);
+            }
+        }
+        else if (available >= rxb->cur_packet_size) {
+            const u8 *packet = read_buf.data + read_buf.cur_offset;
+            const packet_registry_entry &entry = packet_registry[rxb->cur_packet_type];
+
+            // Variable length packets only know their full size once the meta has been read
+            if (entry.packet_size)
+                rxb->cur_packet_size = entry.packet_size(packet);
+
+            if (rxb->cur_packet_size > rxb->memory_budget) {
+                elog("Discarding %s packet of %d bytes - over the rx memory budget of %d bytes",
+                     entry.id,
+                     rxb->cur_packet_size,
+                     rxb->memory_budget);
+                rxb->discard_size = rxb->cur_packet_size;
+                rxb->cur_packet_size = 0;
+                skip_discarded_bytes(read_buf, &available, rxb);
+            }
+            else if (available < rxb->cur_packet_size) {
+                packet_dlog("Waiting on more data for packet size %d - cur available %d and cur offset %d",
+                            rxb->cur_packet_size,
+                            available,
+                            read_buf.cur_offset);
+                need_more_data = true;
+            }
+            else if (sink(packet, rxb->cur_packet_type, rxb->cur_packet_size, conn)) {
+                read_buf.cur_offset += rxb->cur_packet_size;
+                available -= rxb->cur_packet_size;
+                packet_dlog("Read entire packet of %d bytes - ended at offset %d - there are %d remaining available "
+                            "bytes to be read",
+                            rxb->cur_packet_size,
+                            read_buf.cur_offset,
+                            available);
+                rxb->cur_packet_size = 0;
+            }
+            else {
+                need_more_data = true;
+            }
+        }
+        else {
+            packet_dlog("Waiting on more data for packet header size %d - cur available %d and cur offset %d",
+                        rxb->cur_packet_size,
+                        available,
+                        read_buf.cur_offset);
+            need_more_data = true;
+        }
+    }
+    ring_buffer_consume(&rxb->ring, read_buf.cur_offset);
+
+    // Make room for the rest of the packet we are waiting on - done after consuming as growing moves the unread bytes
+    rx_buffer_reserve(rxb, rxb->cur_packet_size);
+}
+
+#if !defined(__EMSCRIPTEN__)
+intern bool net_socket_read(net_connection *conn)
+{
+    sizet free_space = ring_buffer_free_space(conn->rx_buf.ring);
+    if (free_space == 0)
+        return true;
+
+    int rd_cnt = read(conn->socket_handle, ring_buffer_write_ptr(conn->rx_buf.ring), free_space);
+    if (rd_cnt > 0) {
+        ring_buffer_commit(&conn->rx_buf.ring, rd_cnt);
+        packet_dlog("Added %d bytes to available - result:%d", rd_cnt, ring_buffer_available(conn->rx_buf.ring));
+    }
+    else if (rd_cnt < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        elog("Got read error %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Triple buffer holding the most recent complete packet of one type. The I/O thread fills the back slot and swaps it
+// with the middle one, and the render thread swaps the middle slot for its front slot when there is a fresh packet.
+struct latest_packet_mailbox
+{
+    static constexpr u8 INDEX_MASK = 0x3;
+    static constexpr u8 FRESH = 0x4;
+
+    struct slot
+    {
+        u8 *data{};
+        sizet capacity{0};
+        sizet size{0};
+    };
+
+    slot slots[3];
+    std::atomic<u8> middle{0};
+    u8 back{1};
+    u8 front{2};
+};
+
+struct net_rx_thread
+{
+    static constexpr int POLL_TIMEOUT_MS = 5;
+
+    std::thread thread;
+    std::atomic<bool> running{false};
+
+    // Complete packets that must all be dispatched, copied verbatim in the order they were received. The I/O thread
+    // only grows the ring while holding dispatch_lock, which the render thread holds while parsing it.
+    net_rx_buffer dispatch_buf{};
+    std::mutex dispatch_lock;
+
+    // Only used for latest_only packet types
+    latest_packet_mailbox mailboxes[PACKET_TYPE_COUNT];
+};
+
+intern void mailbox_post(latest_packet_mailbox *mb, const u8 *packet, sizet packet_size)
+{
+    latest_packet_mailbox::slot *back = &mb->slots[mb->back];
+    if (back->capacity < packet_size) {
+        back->data = (u8 *)realloc(back->data, packet_size);
+        back->capacity = packet_size;
+    }
+    memcpy(back->data, packet, packet_size);
+    back->size = packet_size;
+    u8 prev_middle = mb->middle.exchange(mb->back | latest_packet_mailbox::FRESH, std::memory_order_acq_rel);
+    mb->back = prev_middle & latest_packet_mailbox::INDEX_MASK;
+}
+
+// Returns null if nothing new has been posted since the last take
+intern const latest_packet_mailbox::slot *mailbox_take(latest_packet_mailbox *mb)
+{
+    if (!test_flags(mb->middle.load(std::memory_order_acquire), latest_packet_mailbox::FRESH))
+        return nullptr;
+    u8 prev_middle = mb->middle.exchange(mb->front, std::memory_order_acq_rel);
+    mb->front = prev_middle & latest_packet_mailbox::INDEX_MASK;
+    return &mb->slots[mb->front];
+}
+
+// Packet sink for the I/O thread - hand complete packets over to the render thread
+intern bool route_packet(const u8 *packet, u8 type, sizet packet_size, net_connection *conn)
+{
+    net_rx_thread *rxt = conn->rx_thread;
+    if (packet_registry[type].latest_only) {
+        mailbox_post(&rxt->mailboxes[type], packet, packet_size);
+        return true;
+    }
+
+    net_rx_buffer *dispb = &rxt->dispatch_buf;
+    if (packet_size > dispb->ring.capacity) {
+        std::lock_guard<std::mutex> lock(rxt->dispatch_lock);
+        if (!rx_buffer_reserve(dispb, packet_size)) {
+            elog("Dropping %s packet of %d bytes - could not grow dispatch buffer",
+                 packet_registry[type].id,
+                 packet_size);
+            return true;
+        }
+    }
+
+    // Leave the packet in the socket buffer until the render thread has made room for it
+    if (ring_buffer_free_space(dispb->ring) < packet_size)
+        return false;
+    ring_buffer_write(&dispb->ring, packet, packet_size);
+    return true;
+}
+
+intern void rx_thread_run(net_connection *conn)
+{
+    net_rx_thread *rxt = conn->rx_thread;
+    pollfd sckt_fd{conn->socket_handle, POLLIN, 0};
+    while (rxt->running.load(std::memory_order_relaxed)) {
+        // Wake up every so often to check for shutdown and to retry packets the dispatch buffer had no room for
+        if (ring_buffer_free_space(conn->rx_buf.ring) > 0)
+            poll(&sckt_fd, 1, net_rx_thread::POLL_TIMEOUT_MS);
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(net_rx_thread::POLL_TIMEOUT_MS));
+
+        if (!net_socket_read(conn)) {
+            elog("Stopping network rx thread");
+            break;
+        }
+        parse_rx_buffer(&conn->rx_buf, route_packet, conn);
+    }
+}
+
+intern void start_rx_thread(net_connection *conn)
+{
+    auto rxt = new net_rx_thread;
+    net_rx_buffer *dispb = &rxt->dispatch_buf;
+    dispb->memory_budget = conn->rx_buf.memory_budget;
+    ring_buffer_init(&dispb->ring, std::min(net_rx_buffer::INITIAL_CAPACITY, dispb->memory_budget));
+    rxt->running = true;
+    conn->rx_thread = rxt;
+    rxt->thread = std::thread(rx_thread_run, conn);
+    ilog("Started network rx thread");
+}
+
+intern void stop_rx_thread(net_connection *conn)
+{
+    net_rx_thread *rxt = conn->rx_thread;
+    if (!rxt)
+        return;
+
+    rxt->running = false;
+    rxt->thread.join();
+    ring_buffer_term(&rxt->dispatch_buf.ring);
+    for (int type = 0; type < PACKET_TYPE_COUNT; ++type) {
+        for (int i = 0; i < 3; ++i)
+            free(rxt->mailboxes[type].slots[i].data);
+    }
+    delete rxt;
+    conn->rx_thread = nullptr;
+    ilog("Stopped network rx thread");
+}
+
+// Render thread side of the I/O thread - dispatch everything it has handed over since the last frame
+intern void drain_rx_thread(net_connection *conn)
+{
+    net_rx_thread *rxt = conn->rx_thread;
+    {
+        std::lock_guard<std::mutex> lock(rxt->dispatch_lock);
+        parse_rx_buffer(&rxt->dispatch_buf, dispatch_packet, conn);
+    }
+
+    for (int type = 0; type < PACKET_TYPE_COUNT; ++type) {
+        const latest_packet_mailbox::slot *latest = mailbox_take(&rxt->mailboxes[type]);
+        if (latest)
+            dispatch_packet(latest->data, type, latest->size, conn);
+    }
+}
+#endif
+
 void net_connect(net_connection *conn, const char *ip, int max_timeout_ms)
 {
+    packet_registry_init();
     alloc_connection(conn);
 #if defined(__EMSCRIPTEN__)
     em_net_connect(conn);
@@ -305,6 +881,8 @@ void net_connect(net_connection *conn, const char *ip, int max_timeout_ms)
     }
     conn->socket_handle = sckt_fd[0].fd;
     ilog("Successfully connected to server at %s on port %d - resulting fd %d", ip, conn->port, sckt_fd[0].fd);
+    if (conn->use_rx_thread)
+        start_rx_thread(conn);
     return;
 
 cleanup:
@@ -313,321 +891,22 @@ cleanup:
 #endif
 }
 
-intern void handle_scan_packet(binary_fixed_buffer_archive<net_rx_buffer::MAX_PACKET_SIZE> &read_buf,
-                               sizet available,
-                               sizet cached_offset,
-                               net_connection *conn)
-{
-    pack_unpack(read_buf, conn->pckts.scan->header, {"header"});
-    pack_unpack(read_buf, conn->pckts.scan->meta, {"meta"});
-
-    sizet meta_and_header_size = read_buf.cur_offset - cached_offset;
-    sizet range_count = (sizet)((conn->pckts.scan->meta.angle_max - conn->pckts.scan->meta.angle_min) /
-                                conn->pckts.scan->meta.angle_increment) + 1;
-    sizet total_packet_size = range_count * sizeof(float) + meta_and_header_size;
-
-    if (available >= total_packet_size) {
-        pack_unpack(read_buf,
-                    conn->pckts.scan->ranges,
-                    {"change_elems", {pack_va_flags::FIXED_ARRAY_CUSTOM_SIZE, &range_count}});
-        conn->scan_received(0, *conn->pckts.scan);
-    }
-    else {
-        // Not all bytes have come in for packet - set back the cur_offset to what it was before reading the meta data
-        read_buf.cur_offset = cached_offset;
-    }
-}
-
-intern void handle_occ_grid_pckt(binary_fixed_buffer_archive<net_rx_buffer::MAX_PACKET_SIZE> &read_buf,
-                                 sizet available,
-                                 sizet cached_offset,
-                                 occ_grid_update *gu,
-                                 ss_signal<const occ_grid_update &> &sig)
-{
-    pack_unpack(read_buf, gu->header, {"header"});
-    pack_unpack(read_buf, gu->meta, {"meta"});
-
-    sizet meta_and_header_size = read_buf.cur_offset - cached_offset;
-    sizet total_packet_size = gu->meta.change_elem_count * sizeof(u32) + meta_and_header_size;
-
-    if (available >= total_packet_size) {
-        pack_unpack(read_buf,
-                    gu->change_elems,
-                    {"change_elems", {pack_va_flags::FIXED_ARRAY_CUSTOM_SIZE, &gu->meta.change_elem_count}});
-        sig(0, *gu);
-    }
-    else {
-        // Not all bytes have come in for packet - set back the cur_offset to what it was before reading the meta data
-        read_buf.cur_offset = cached_offset;
-    }
-}
-
-intern void handle_nav_path_packet(binary_fixed_buffer_archive<net_rx_buffer::MAX_PACKET_SIZE> &read_buf,
-                                   sizet available,
-                                   sizet cached_offset,
-                                   nav_path *npckt,
-                                   ss_signal<const nav_path &> &sig)
-{
-    static sizet pose_size = packed_sizeof<pose>();
-    pack_unpack(read_buf, npckt->header, {"header"});
-    pack_unpack(read_buf, npckt->path_cnt, {"path_cnt"});
-
-    sizet meta_and_header_size = read_buf.cur_offset - cached_offset;
-    sizet total_packet_size = npckt->path_cnt * pose_size + meta_and_header_size;
-
-    if (available >= total_packet_size) {
-        pack_unpack(read_buf, npckt->path, {"path", {pack_va_flags::FIXED_ARRAY_CUSTOM_SIZE, &npckt->path_cnt}});
-        sig(0, *npckt);
-    }
-    else {
-        // Not all bytes have come in for packet - set back the cur_offset to what it was before reading the meta data
-        read_buf.cur_offset = cached_offset;
-    }
-}
-
-intern void handle_text_block_packet(binary_fixed_buffer_archive<net_rx_buffer::MAX_PACKET_SIZE> &read_buf,
-                                     sizet available,
-                                     sizet cached_offset,
-                                     text_block *txt_pckt,
-                                     ss_signal<const text_block &> &sig)
-{
-    pack_unpack(read_buf, txt_pckt->header, {"header"});
-    pack_unpack(read_buf, txt_pckt->txt_size, {"txt_size"});
-
-    sizet meta_and_header_size = read_buf.cur_offset - cached_offset;
-    sizet total_packet_size = txt_pckt->txt_size + meta_and_header_size;
-
-    if (available >= total_packet_size) {
-        pack_unpack(read_buf, txt_pckt->text, {"text", {pack_va_flags::FIXED_ARRAY_CUSTOM_SIZE, &txt_pckt->txt_size}});
-        sig(0, *txt_pckt);
-    }
-    else {
-        // Not all bytes have come in for packet - set back the cur_offset to what it was before reading the meta data
-        read_buf.cur_offset = cached_offset;
-    }
-}
-
-intern void handle_comp_img_packet(binary_fixed_buffer_archive<net_rx_buffer::MAX_PACKET_SIZE> &read_buf,
-                                   sizet available,
-                                   sizet cached_offset,
-                                   compressed_image *img,
-                                   ss_signal<const compressed_image &> &sig)
-{
-    pack_unpack(read_buf, img->header, {"header"});
-    pack_unpack(read_buf, img->meta, {"meta"});
-
-    sizet meta_and_header_size = read_buf.cur_offset - cached_offset;
-    sizet total_packet_size = img->meta.data_size + meta_and_header_size;
-
-    if (available >= total_packet_size) {
-        pack_unpack(read_buf, img->data, {"data", {pack_va_flags::FIXED_ARRAY_CUSTOM_SIZE, &img->meta.data_size}});
-        sig(0, *img);
-    }
-    else {
-        // Not all bytes have come in for packet - set back the cur_offset to what it was before reading the meta data
-        read_buf.cur_offset = cached_offset;
-    }
-}
-
-intern void handle_goal_status_packet(binary_fixed_buffer_archive<net_rx_buffer::MAX_PACKET_SIZE> &read_buf,
-                                      net_connection *conn)
-{
-    pack_unpack(read_buf, *conn->pckts.cur_goal_stat, {});
-    conn->goal_status_updated(0, *conn->pckts.cur_goal_stat);
-}
-
-intern void handle_tform_packet(binary_fixed_buffer_archive<net_rx_buffer::MAX_PACKET_SIZE> &read_buf,
-                                net_connection *conn)
-{
-    pack_unpack(read_buf, *conn->pckts.ntf, {});
-    conn->transform_updated(0, *conn->pckts.ntf);
-}
-
-intern void handle_misc_stats(binary_fixed_buffer_archive<net_rx_buffer::MAX_PACKET_SIZE> &read_buf, net_connection *conn)
-{
-    pack_unpack(read_buf, *conn->pckts.ms, {});
-    conn->meta_stats_update(0, *conn->pckts.ms);
-}
-
-intern bool matches_packet_id(const char *packet_id, const u8 *data)
-{
-    int result = strncmp((const char *)data, packet_id, packet_header::size);
-    return (result == 0);
-}
-
-// Add different packet types to these two functions using helper macros
-intern sizet matching_packet_size(u8 *data)
-{
-    static sizet scan_size = packed_sizeof<lidar_scan_meta>();
-    static sizet occ_meta = packed_sizeof<occ_grid_meta>();
-    static sizet node_tform = packed_sizeof<node_transform>();
-    static sizet nav_path_meta = sizeof(u32);
-    static sizet goal_status = packed_sizeof<current_goal_status>();
-    static sizet txt_block_sz = packed_sizeof<text_block>();
-    static sizet img_meta = packed_sizeof<compressed_image_meta>();
-    static sizet mstats = packed_sizeof<misc_stats>();
-
-    if (matches_packet_id(SCAN_PACKET_ID, data)) {
-        return scan_size;
-    }
-    else if (matches_packet_id(LOC_CM_PCKT_ID, data) || matches_packet_id(MAP_PCKT_ID, data) ||
-             matches_packet_id(GLOB_CM_PCKT_ID, data)) {
-        return occ_meta;
-    }
-    else if (matches_packet_id(GLOB_NAVP_PCKT_ID, data) || matches_packet_id(LOC_NAVP_PCKT_ID, data)) {
-        return nav_path_meta;
-    }
-    else if (matches_packet_id(TFORM_PCKT_ID, data)) {
-        return node_tform;
-    }
-    else if (matches_packet_id(GOAL_STAT_PCKT_ID, data)) {
-        return goal_status;
-    }
-    else if (matches_packet_id(SET_PARAMS_RESP_CMD_PCKT_ID, data) ||
-             matches_packet_id(GET_PARAMS_RESP_CMD_PCKT_ID, data)) {
-        return txt_block_sz;
-    }
-    else if (matches_packet_id(COMP_IMG_PCKT_ID, data)) {
-        return img_meta;
-    }
-    else if (matches_packet_id(MISC_STATS_PCKT_ID, data)) {
-        return mstats;
-    }
-    return 0;
-}
-
-intern sizet dispatch_received_packet(binary_fixed_buffer_archive<net_rx_buffer::MAX_PACKET_SIZE> &read_buf,
-                                      sizet available,
-                                      net_connection *conn)
-{
-    sizet cached_offset = read_buf.cur_offset;
-    if (matches_packet_id(SCAN_PACKET_ID, read_buf.data + read_buf.cur_offset)) {
-        handle_scan_packet(read_buf, available, cached_offset, conn);
-    }
-    else if (matches_packet_id(TFORM_PCKT_ID, read_buf.data + read_buf.cur_offset)) {
-        handle_tform_packet(read_buf, conn);
-    }
-    else if (matches_packet_id(MISC_STATS_PCKT_ID, read_buf.data + read_buf.cur_offset)) {
-        handle_misc_stats(read_buf, conn);
-    }
-    else if (matches_packet_id(GOAL_STAT_PCKT_ID, read_buf.data + read_buf.cur_offset)) {
-        handle_goal_status_packet(read_buf, conn);
-    }
-    else if (matches_packet_id(LOC_CM_PCKT_ID, read_buf.data + read_buf.cur_offset)) {
-        handle_occ_grid_pckt(read_buf, available, cached_offset, conn->pckts.gu, conn->loc_cm_update_received);
-    }
-    else if (matches_packet_id(GLOB_CM_PCKT_ID, read_buf.data + read_buf.cur_offset)) {
-        handle_occ_grid_pckt(read_buf, available, cached_offset, conn->pckts.gu, conn->glob_cm_update_received);
-    }
-    else if (matches_packet_id(MAP_PCKT_ID, read_buf.data + read_buf.cur_offset)) {
-        handle_occ_grid_pckt(read_buf, available, cached_offset, conn->pckts.gu, conn->map_update_received);
-    }
-    else if (matches_packet_id(LOC_NAVP_PCKT_ID, read_buf.data + read_buf.cur_offset)) {
-        handle_nav_path_packet(read_buf, available, cached_offset, conn->pckts.navp, conn->loc_nav_path_updated);
-    }
-    else if (matches_packet_id(GLOB_NAVP_PCKT_ID, read_buf.data + read_buf.cur_offset)) {
-        handle_nav_path_packet(read_buf, available, cached_offset, conn->pckts.navp, conn->glob_nav_path_updated);
-    }
-    else if (matches_packet_id(SET_PARAMS_RESP_CMD_PCKT_ID, read_buf.data + read_buf.cur_offset)) {
-        handle_text_block_packet(read_buf, available, cached_offset, conn->pckts.txt, conn->param_set_response_received);
-    }
-    else if (matches_packet_id(GET_PARAMS_RESP_CMD_PCKT_ID, read_buf.data + read_buf.cur_offset)) {
-        handle_text_block_packet(read_buf, available, cached_offset, conn->pckts.txt, conn->param_get_response_received);
-    }
-    else if (matches_packet_id(COMP_IMG_PCKT_ID, read_buf.data + read_buf.cur_offset)) {
-        handle_comp_img_packet(read_buf, available, cached_offset, conn->pckts.img, conn->image_update);
-    }
-    return read_buf.cur_offset - cached_offset;
-}
-
-intern bool net_socket_read(net_connection *conn)
-{
-    int rd_cnt = read(conn->socket_handle,
-                      conn->rx_buf->read_buf.data + conn->rx_buf->read_buf.cur_offset + conn->rx_buf->available,
-                      net_rx_buffer::MAX_PACKET_SIZE - conn->rx_buf->read_buf.cur_offset - conn->rx_buf->available);
-    if (rd_cnt > 0) {
-        conn->rx_buf->available += rd_cnt;
-        packet_dlog("Added %d bytes to available - result:%d", rd_cnt, conn->rx_buf->available);
-    }
-    else if (rd_cnt < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-        elog("Got read error %s", strerror(errno));
-        return false;
-    }
-    return true;
-}
-
 void net_rx(net_connection *conn)
 {
-    static sizet current_packet_size{0};
-
     if (conn->socket_handle <= 0)
         return;
 
-    assert(net_rx_buffer::MAX_PACKET_SIZE - conn->rx_buf->available > 0 &&
-           "Read buffer size is too small - can't receive complete packet");
-
 #if !defined(__EMSCRIPTEN__)
+    if (conn->rx_thread) {
+        drain_rx_thread(conn);
+        return;
+    }
+
     if (!net_socket_read(conn))
         return;
 #endif
 
-    // While there are enough available bytes to read in a message header and we
-    // are not waiting for more data
-    bool need_more_data = false;
-    while (conn->rx_buf->available >= packet_header::size && !need_more_data) {
-        // Current packet size of 0 indicates we are searching for a header
-        if (current_packet_size == 0) {
-            current_packet_size = matching_packet_size(conn->rx_buf->read_buf.data + conn->rx_buf->read_buf.cur_offset);
-
-            // If no header match is found
-            if (current_packet_size == 0) {
-                --conn->rx_buf->available;
-                ++conn->rx_buf->read_buf.cur_offset;
-            }
-            else {
-                packet_dlog("Found packet header for packet size %d (conn->rx_buf->available:%d  Readbuf offset:%d)",
-                            current_packet_size,
-                            conn->rx_buf->available,
-                            conn->rx_buf->read_buf.cur_offset);
-            }
-        }
-        else if (conn->rx_buf->available >= current_packet_size) {
-            sizet bytes_processed = dispatch_received_packet(conn->rx_buf->read_buf, conn->rx_buf->available, conn);
-            if (bytes_processed > 0) {
-                // Bytes processed will be zero unless we have received ALL bytes required
-                // For messages with variable length data - bytes processed will only be non zero
-                // if ALL data (meta and payload) for the variable length message was received
-                conn->rx_buf->available -= bytes_processed;
-                packet_dlog("Read entire packet of %d bytes - ended at offset %d (packet size before was %d) - there "
-                            "are %d remaining conn->rx_buf->available bytes to be read",
-                            bytes_processed,
-                            conn->rx_buf->read_buf.cur_offset,
-                            current_packet_size,
-                            conn->rx_buf->available);
-
-                current_packet_size = 0;
-            }
-            else {
-                packet_dlog("Waiting on more data for packet header size %d - cur available %d and cur offset %d",
-                            current_packet_size,
-                            conn->rx_buf->available,
-                            conn->rx_buf->read_buf.cur_offset);
-                need_more_data = true;
-            }
-        }
-        else {
-            packet_dlog("Waiting on more data for packet header size %d - cur available %d and cur offset %d",
-                        current_packet_size,
-                        conn->rx_buf->available,
-                        conn->rx_buf->read_buf.cur_offset);
-            need_more_data = true;
-        }
-    }
-
-    if (conn->rx_buf->available == 0) {
-        conn->rx_buf->read_buf.cur_offset = 0;
-        // packet_dlog("Read all available data on channel - moving pointer to buffer start");
-    }
+    parse_rx_buffer(&conn->rx_buf, dispatch_packet, conn);
 }
 
 void net_tx(const net_connection &conn, const u8 *data, sizet data_size)
@@ -654,6 +933,7 @@ void net_disconnect(net_connection *conn)
     emscripten_websocket_close(conn->socket_handle, 0, "Disconnected");
     emscripten_websocket_delete(conn->socket_handle);
 #else
+    stop_rx_thread(conn);
     if (conn->socket_handle > 0)
         close(conn->socket_handle);
 #endif
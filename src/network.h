@@ -4,6 +4,7 @@
 #include "ss_router.h"
 #include "math_utils.h"
 #include "pack_unpack.h"
+#include "ring_buffer.h"
 
 inline const char *SCAN_PACKET_ID = "SCAN_PCKT_ID";
 inline const char *MAP_PCKT_ID = "MAP_PCKT_ID";
@@ -28,6 +29,26 @@ inline const char *CLEAR_MAPS_CMD_HEADER = "CLEAR_MAPS_PCKT_ID";
 inline const char *SET_PARAMS_CMD_HEADER = "SET_PARAMS_CMD_PCKT_ID";
 inline const char *GET_PARAMS_CMD_HEADER = "GET_PARAMS_CMD_PCKT_ID";
 
+/// Integer codes for every packet type we can receive - the string IDs above are hashed to these once at startup so
+/// classifying a header is a single lookup rather than a strncmp against each ID
+enum packet_type : u8
+{
+    PACKET_TYPE_SCAN,
+    PACKET_TYPE_MAP,
+    PACKET_TYPE_GLOB_CM,
+    PACKET_TYPE_LOC_CM,
+    PACKET_TYPE_TFORM,
+    PACKET_TYPE_GLOB_NAVP,
+    PACKET_TYPE_LOC_NAVP,
+    PACKET_TYPE_GOAL_STAT,
+    PACKET_TYPE_SET_PARAMS_RESP,
+    PACKET_TYPE_GET_PARAMS_RESP,
+    PACKET_TYPE_COMP_IMG,
+    PACKET_TYPE_MISC_STATS,
+    PACKET_TYPE_COUNT,
+    PACKET_TYPE_INVALID = PACKET_TYPE_COUNT
+};
+
 static constexpr int MAX_MAP_SIZE = 4000;
 static constexpr int MAX_IMAGE_SIZE = 1024;
 struct dvec3
@@ -383,28 +404,110 @@ pup_func(current_goal_status)
     pup_member(goal_p);
 }
 
-/// Only malloc these once and reuse on every time a packet comes in
+/// Packed array of T pointing directly into the receive buffer. Elements are copied out on access as the buffer gives
+/// no alignment guarantees, so T's packed layout must match its in memory layout.
+template<class T>
+struct rx_span
+{
+    static_assert(std::is_trivially_copyable_v<T>, "Span elements are copied straight out of the receive buffer");
+
+    const u8 *data{};
+    sizet size{0};
+
+    T operator[](sizet ind) const
+    {
+        T ret;
+        memcpy(&ret, data + ind * sizeof(T), sizeof(T));
+        return ret;
+    }
+};
+
+/// Zero copy view of a variable length packet - the header and meta are decoded but the payload spans point into the
+/// receive buffer and are only valid for the duration of the signal emission that delivers the view
+template<class T>
+struct packet_view;
+
+template<>
+struct packet_view<lidar_scan>
+{
+    packet_header header;
+    lidar_scan_meta meta;
+    rx_span<float> ranges;
+};
+
+template<>
+struct packet_view<occ_grid_update>
+{
+    packet_header header;
+    occ_grid_meta meta;
+    rx_span<u32> change_elems;
+};
+
+static_assert(sizeof(pose) == 7 * sizeof(double), "Packed pose must match the in memory pose for rx_span");
+
+template<>
+struct packet_view<nav_path>
+{
+    packet_header header;
+    u32 path_cnt;
+    rx_span<pose> path;
+};
+
+template<>
+struct packet_view<text_block>
+{
+    packet_header header;
+    u32 txt_size;
+    rx_span<char> text;
+};
+
+template<>
+struct packet_view<compressed_image>
+{
+    packet_header header;
+    compressed_image_meta meta;
+    rx_span<u8> data;
+};
+
+/// Only malloc these once and reuse on every time a packet comes in - variable length packets are not copied out of the
+/// receive buffer, see packet_view
 struct reusable_packets
 {
     // Packets for receiving
-    occ_grid_update *gu{};
-    lidar_scan *scan{};
     node_transform *ntf{};
-    nav_path *navp{};
     current_goal_status *cur_goal_stat{};
-    text_block *txt{};
-    compressed_image *img{};
     misc_stats *ms{};
 
     // Packets for sending
     command_set_params *cmdp{};
 };
 
+struct net_rx_thread;
+
 struct net_rx_buffer
 {
-    static constexpr int MAX_PACKET_SIZE = occ_grid_update::MAX_CHANGE_ELEMS * 4 + 1000;
-    binary_fixed_buffer_archive<MAX_PACKET_SIZE> read_buf{PACK_DIR_IN};
-    sizet available;
+    // The largest packet the server can send - the default memory budget
+    static constexpr sizet MAX_PACKET_SIZE = occ_grid_update::MAX_CHANGE_ELEMS * 4 + 1000;
+
+    // The ring starts out at this size and grows to fit the packet sizes announced in each packet's meta
+    static constexpr sizet INITIAL_CAPACITY = 64 * 1024;
+
+    // Filled by the socket read or websocket callback and drained by the packet parser
+    ring_buffer ring{};
+
+    // The ring never grows past this - packets announcing a larger size are discarded
+    sizet memory_budget{MAX_PACKET_SIZE};
+
+    // Largest number of bytes the ring has had to hold at once
+    sizet high_water_mark{0};
+
+    // Size required before the current packet can be dispatched - zero means we are searching for a header. Handlers
+    // for variable length packets raise this to the full packet size once the meta has been read.
+    sizet cur_packet_size;
+    u8 cur_packet_type;
+
+    // Bytes left of an over budget packet being skipped
+    sizet discard_size{0};
 };
 
 struct net_connection
@@ -413,21 +516,26 @@ struct net_connection
     bool is_husky{false};
     int port;
 
-    net_rx_buffer *rx_buf{};
+    net_rx_buffer rx_buf{};
     reusable_packets pckts{};
+
+    // Native only - read and parse packets on a dedicated I/O thread, and have net_rx just dispatch what it has handed
+    // over. Must be set before connecting.
+    bool use_rx_thread{false};
+    net_rx_thread *rx_thread{};
     bool can_control{true};
 
-    ss_signal<const lidar_scan &> scan_received;
-    ss_signal<const occ_grid_update &> map_update_received;
-    ss_signal<const occ_grid_update &> glob_cm_update_received;
-    ss_signal<const occ_grid_update &> loc_cm_update_received;
+    ss_signal<const packet_view<lidar_scan> &> scan_received;
+    ss_signal<const packet_view<occ_grid_update> &> map_update_received;
+    ss_signal<const packet_view<occ_grid_update> &> glob_cm_update_received;
+    ss_signal<const packet_view<occ_grid_update> &> loc_cm_update_received;
     ss_signal<const node_transform &> transform_updated;
-    ss_signal<const nav_path &> glob_nav_path_updated;
-    ss_signal<const nav_path &> loc_nav_path_updated;
+    ss_signal<const packet_view<nav_path> &> glob_nav_path_updated;
+    ss_signal<const packet_view<nav_path> &> loc_nav_path_updated;
     ss_signal<const current_goal_status &> goal_status_updated;
-    ss_signal<const text_block &> param_set_response_received;
-    ss_signal<const text_block &> param_get_response_received;
-    ss_signal<const compressed_image &> image_update;
+    ss_signal<const packet_view<text_block> &> param_set_response_received;
+    ss_signal<const packet_view<text_block> &> param_get_response_received;
+    ss_signal<const packet_view<compressed_image> &> image_update;
     ss_signal<const misc_stats &> meta_stats_update;
 };
 
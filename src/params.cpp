@@ -100,10 +100,10 @@ intern void setup_accept_params_button(map_panel *mp, const ui_info &ui_inf)
     mp->accept_inp.get_btn_text->SetFontSize(24 * ui_inf.dev_pixel_ratio_inv);
 }
 
-intern void show_received_text(map_panel *mp, const text_block &tb, const ui_info &ui_inf)
+intern void show_received_text(map_panel *mp, const packet_view<text_block> &tb, const ui_info &ui_inf)
 {
     static char txt[5000] = {};
-    strncpy(txt, tb.text, tb.txt_size);
+    strncpy(txt, (const char *)tb.text.data, tb.txt_size);
     txt[tb.txt_size] = '\0';
 
     auto txt_elem = new urho::Text(mp->view->GetContext());
@@ -126,10 +126,10 @@ intern void show_received_text(map_panel *mp, const text_block &tb, const ui_inf
     }
 }
 
-intern void handle_received_get_params_response(map_panel *mp, const text_block &tb, const ui_info &ui_inf)
+intern void handle_received_get_params_response(map_panel *mp, const packet_view<text_block> &tb, const ui_info &ui_inf)
 {
     static char txt[text_block::MAX_TXT_SIZE] = {};
-    strncpy(txt, tb.text, tb.txt_size);
+    strncpy(txt, (const char *)tb.text.data, tb.txt_size);
     txt[tb.txt_size] = '\0';
     ilog("Recieved text: %s", txt);
     mp->accept_inp.get_btn_text->SetText("Get Params");
@@ -158,10 +158,10 @@ void param_init(map_panel *mp, net_connection *conn, const ui_info &ui_inf)
     setup_accept_params_button(mp, ui_inf);
     setup_text_notice_widget(mp, ui_inf);
 
-    ss_connect(&mp->router, conn->param_set_response_received, [mp, ui_inf](const text_block &pckt) {
+    ss_connect(&mp->router, conn->param_set_response_received, [mp, ui_inf](const packet_view<text_block> &pckt) {
         show_received_text(mp, pckt, ui_inf);
     });
-    ss_connect(&mp->router, conn->param_get_response_received, [mp, ui_inf](const text_block &pckt) {
+    ss_connect(&mp->router, conn->param_get_response_received, [mp, ui_inf](const packet_view<text_block> &pckt) {
         handle_received_get_params_response(mp, pckt, ui_inf);
     });
 
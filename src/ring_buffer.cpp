@@ -0,0 +1,176 @@
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+#define RING_BUFFER_DOUBLE_MAP
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "logging.h"
+#include "ring_buffer.h"
+
+#if defined(RING_BUFFER_DOUBLE_MAP)
+// Map the same memory file twice, one view directly after the other, so reading or writing past the end of the first
+// view lands at the start of the buffer
+intern bool map_double(ring_buffer *rb, sizet capacity)
+{
+    int fd = memfd_create("ring_buffer", 0);
+    if (fd == -1) {
+        wlog("Failed to create ring buffer memory file: %s", strerror(errno));
+        return false;
+    }
+
+    if (ftruncate(fd, capacity) != 0) {
+        wlog("Failed to size ring buffer memory file to %d bytes: %s", capacity, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    // Reserve the whole range first so nothing else can get mapped between the two views
+    u8 *base = (u8 *)mmap(nullptr, capacity * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        wlog("Failed to reserve %d bytes for ring buffer: %s", capacity * 2, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    void *lower = mmap(base, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    void *upper = mmap(base + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    close(fd);
+    if (lower != base || upper != base + capacity) {
+        wlog("Failed to map ring buffer views: %s", strerror(errno));
+        munmap(base, capacity * 2);
+        return false;
+    }
+
+    rb->data = base;
+    rb->capacity = capacity;
+    rb->double_mapped = true;
+    return true;
+}
+#endif
+
+// Copy count bytes written at offset to their twin in the other half - only needed when not double mapped
+intern void mirror_range(ring_buffer *rb, sizet offset, sizet count)
+{
+    sizet lower_count = count;
+    if (lower_count > rb->capacity - offset)
+        lower_count = rb->capacity - offset;
+    memcpy(rb->data + rb->capacity + offset, rb->data + offset, lower_count);
+    if (count > lower_count)
+        memcpy(rb->data, rb->data + rb->capacity, count - lower_count);
+}
+
+bool ring_buffer_init(ring_buffer *rb, sizet min_capacity)
+{
+    rb->write_pos = 0;
+    rb->read_pos = 0;
+
+#if defined(RING_BUFFER_DOUBLE_MAP)
+    sizet page_size = sysconf(_SC_PAGESIZE);
+    sizet capacity = ((min_capacity + page_size - 1) / page_size) * page_size;
+    if (map_double(rb, capacity)) {
+        ilog("Created double mapped ring buffer with capacity %d", rb->capacity);
+        return true;
+    }
+#endif
+
+    rb->data = (u8 *)malloc(min_capacity * 2);
+    if (!rb->data) {
+        elog("Failed to allocate %d bytes for ring buffer", min_capacity * 2);
+        return false;
+    }
+    rb->capacity = min_capacity;
+    rb->double_mapped = false;
+    ilog("Created mirrored ring buffer with capacity %d", rb->capacity);
+    return true;
+}
+
+void ring_buffer_term(ring_buffer *rb)
+{
+#if defined(RING_BUFFER_DOUBLE_MAP)
+    if (rb->double_mapped)
+        munmap(rb->data, rb->capacity * 2);
+    else
+        free(rb->data);
+#else
+    free(rb->data);
+#endif
+    rb->data = nullptr;
+    rb->capacity = 0;
+    rb->write_pos = 0;
+    rb->read_pos = 0;
+}
+
+bool ring_buffer_grow(ring_buffer *rb, sizet min_capacity)
+{
+    if (min_capacity <= rb->capacity)
+        return true;
+
+    ring_buffer grown;
+    if (!ring_buffer_init(&grown, min_capacity))
+        return false;
+
+    sizet unread = ring_buffer_available(*rb);
+    ring_buffer_write(&grown, ring_buffer_read_ptr(*rb), unread);
+    ring_buffer_term(rb);
+
+    rb->data = grown.data;
+    rb->capacity = grown.capacity;
+    rb->double_mapped = grown.double_mapped;
+    rb->write_pos = unread;
+    rb->read_pos = 0;
+    return true;
+}
+
+void ring_buffer_reset(ring_buffer *rb)
+{
+    rb->write_pos = 0;
+    rb->read_pos = 0;
+}
+
+sizet ring_buffer_available(const ring_buffer &rb)
+{
+    return rb.write_pos.load(std::memory_order_acquire) - rb.read_pos.load(std::memory_order_relaxed);
+}
+
+u8 *ring_buffer_read_ptr(const ring_buffer &rb)
+{
+    return rb.data + rb.read_pos.load(std::memory_order_relaxed) % rb.capacity;
+}
+
+void ring_buffer_consume(ring_buffer *rb, sizet byte_count)
+{
+    u64 pos = rb->read_pos.load(std::memory_order_relaxed);
+    rb->read_pos.store(pos + byte_count, std::memory_order_release);
+}
+
+sizet ring_buffer_free_space(const ring_buffer &rb)
+{
+    return rb.capacity - (rb.write_pos.load(std::memory_order_relaxed) - rb.read_pos.load(std::memory_order_acquire));
+}
+
+u8 *ring_buffer_write_ptr(const ring_buffer &rb)
+{
+    return rb.data + rb.write_pos.load(std::memory_order_relaxed) % rb.capacity;
+}
+
+void ring_buffer_commit(ring_buffer *rb, sizet byte_count)
+{
+    u64 pos = rb->write_pos.load(std::memory_order_relaxed);
+    if (!rb->double_mapped)
+        mirror_range(rb, pos % rb->capacity, byte_count);
+    rb->write_pos.store(pos + byte_count, std::memory_order_release);
+}
+
+sizet ring_buffer_write(ring_buffer *rb, const u8 *src, sizet byte_count)
+{
+    sizet free_space = ring_buffer_free_space(*rb);
+    if (byte_count > free_space)
+        byte_count = free_space;
+    memcpy(ring_buffer_write_ptr(*rb), src, byte_count);
+    ring_buffer_commit(rb, byte_count);
+    return byte_count;
+}
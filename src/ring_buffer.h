@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+
+#include "typedefs.h"
+
+/// Single producer single consumer byte ring buffer. The storage is mapped twice back to back (or mirrored on every
+/// write where double mapping isn't available) so the readable and writable ranges are always contiguous in memory,
+/// even when they cross the end of the buffer - packets spanning the wrap point can be decoded in place.
+struct ring_buffer
+{
+    u8 *data{};
+    sizet capacity{0};
+    bool double_mapped{false};
+
+    // Monotonic byte counts - only the producer stores write_pos and only the consumer stores read_pos
+    std::atomic<u64> write_pos{0};
+    std::atomic<u64> read_pos{0};
+};
+
+bool ring_buffer_init(ring_buffer *rb, sizet min_capacity);
+void ring_buffer_term(ring_buffer *rb);
+
+// Reallocate with at least min_capacity bytes keeping any unread bytes - like reset, only call when neither the
+// producer nor the consumer are using the buffer. Existing read and write pointers are invalidated.
+bool ring_buffer_grow(ring_buffer *rb, sizet min_capacity);
+
+// Only call when neither the producer nor the consumer are using the buffer
+void ring_buffer_reset(ring_buffer *rb);
+
+// Consumer side - the read pointer is valid for ring_buffer_available bytes
+sizet ring_buffer_available(const ring_buffer &rb);
+u8 *ring_buffer_read_ptr(const ring_buffer &rb);
+void ring_buffer_consume(ring_buffer *rb, sizet byte_count);
+
+// Producer side - the write pointer is valid for ring_buffer_free_space bytes, which become readable on commit
+sizet ring_buffer_free_space(const ring_buffer &rb);
+u8 *ring_buffer_write_ptr(const ring_buffer &rb);
+void ring_buffer_commit(ring_buffer *rb, sizet byte_count);
+
+// Copy and commit as much of src as fits - returns the number of bytes written
+sizet ring_buffer_write(ring_buffer *rb, const u8 *src, sizet byte_count);
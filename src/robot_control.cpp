@@ -73,7 +73,13 @@ intern void setup_main_renderer(robot_control_ctxt *ctxt)
     zn->SetFogColor({0.0, 0.0, 0.0, 1.0});
 }
 
-intern void parse_command_line_args(int *port, urho::String *ip, float *ui_scale, bool *is_husky, const urho::StringVector &args)
+intern void parse_command_line_args(int *port,
+                                   urho::String *ip,
+                                   float *ui_scale,
+                                   bool *is_husky,
+                                   sizet *rx_budget,
+                                   bool *rx_thread,
+                                   const urho::StringVector &args)
 {
     for (const auto &arg : args) {
         auto split = arg.Split('=');
@@ -91,6 +97,13 @@ intern void parse_command_line_args(int *port, urho::String *ip, float *ui_scale
             else if (split[0] == "-husky") {
                 *is_husky = strtol(split[1].CString(), nullptr, 10);
             }
+            else if (split[0] == "-rx_budget_mb") {
+                *rx_budget = strtoul(split[1].CString(), nullptr, 10) * 1024 * 1024;
+                ilog("Setting rx memory budget to %d bytes", *rx_budget);
+            }
+            else if (split[0] == "-rx_thread") {
+                *rx_thread = strtol(split[1].CString(), nullptr, 10);
+            }
         }
     }
 }
@@ -107,7 +120,13 @@ bool robot_ctrl_init(robot_control_ctxt *ctxt, const urho::StringVector &args)
 
     int port{4000};
     urho::String ip{"127.0.0.1"};
-    parse_command_line_args(&port, &ip, &ctxt->ui_inf.dev_pixel_ratio_inv, &ctxt->conn.is_husky, args);
+    parse_command_line_args(&port,
+                            &ip,
+                            &ctxt->ui_inf.dev_pixel_ratio_inv,
+                            &ctxt->conn.is_husky,
+                            &ctxt->conn.rx_buf.memory_budget,
+                            &ctxt->conn.use_rx_thread,
+                            args);
 
     if (!init_urho_engine(ctxt->urho_engine, ctxt->ui_inf.dev_pixel_ratio_inv))
         return false;